@@ -6,8 +6,43 @@
 #include <cassert>
 #include <cstring>
 #include <ostream>
+#include <stdint.h>
 #include <string>
 
+/** Compare two NUL-terminated strings a word at a time, returning a
+ * result with the same sign convention as strcmp. The pointers are
+ * first advanced byte-wise to a word boundary; an aligned word cannot
+ * cross a page, so reading the bytes following the terminator is
+ * safe. When the two pointers are not mutually alignable, fall back
+ * to strcmp. */
+inline int compareCString(const char* a, const char* b)
+{
+	typedef uint64_t word;
+	if ((uintptr_t)a % sizeof(word)
+			!= (uintptr_t)b % sizeof(word))
+		return strcmp(a, b);
+	for (; (uintptr_t)a % sizeof(word) != 0; a++, b++)
+		if (*a != *b || *a == '\0')
+			return (unsigned char)*a - (unsigned char)*b;
+	for (;; a += sizeof(word), b += sizeof(word)) {
+		word x, y;
+		memcpy(&x, a, sizeof x);
+		memcpy(&y, b, sizeof y);
+		// True if any byte of x is zero.
+		bool hasZero = (x - (word)0x0101010101010101ULL) & ~x
+			& (word)0x8080808080808080ULL;
+		if (x != y || hasZero) {
+			for (size_t i = 0; i < sizeof(word); i++) {
+				if (a[i] != b[i])
+					return (unsigned char)a[i]
+						- (unsigned char)b[i];
+				if (a[i] == '\0')
+					return 0;
+			}
+		}
+	}
+}
+
 /** An immutable string that does not allocate resources. */
 class cstring {
   public:
@@ -24,12 +59,12 @@ class cstring {
 
 	bool operator==(const cstring& o) const
 	{
-		return m_p == o.m_p || strcmp(m_p, o.m_p) == 0;
+		return m_p == o.m_p || compareCString(m_p, o.m_p) == 0;
 	}
 
 	bool operator<(const cstring& o) const
 	{
-		return m_p != o.m_p && strcmp(m_p, o.m_p) < 0;
+		return m_p != o.m_p && compareCString(m_p, o.m_p) < 0;
 	}
 
 	friend std::ostream& operator<<(std::ostream& out,
@@ -42,47 +77,42 @@ class cstring {
 	const char* m_p;
 };
 
-/** An immutable string. */
+/** Allocate n bytes of character data for a const_string. The
+ * strings are small, numerous and live until the program exits, so
+ * they are carved out of large blocks that are never freed. A bump
+ * allocator also keeps the data of consecutively-created strings
+ * adjacent in memory. */
+inline const char* constStringArenaAlloc(size_t n)
+{
+	const size_t BLOCK_SIZE = 1024 * 1024;
+	static char* block;
+	static size_t remaining;
+	if (n > remaining) {
+		size_t blockSize = n > BLOCK_SIZE ? n : BLOCK_SIZE;
+		block = new char[blockSize];
+		remaining = blockSize;
+	}
+	char* p = block;
+	block += n;
+	remaining -= n;
+	return p;
+}
+
+/** An immutable string. The character data is owned by the arena, so
+ * copies share it, and a cstring pointing at a const_string stays
+ * valid when a vector of const_string grows. */
 class const_string : public cstring {
   public:
 	const_string(const std::string& s)
-		: cstring(strcpy(new char[s.size() + 1], s.c_str())) { }
-
-#if __GXX_EXPERIMENTAL_CXX0X__
-	const_string(const_string&& s) : cstring(s.m_p) { s.m_p = NULL; }
-#endif
-
-#if 0
-	/* Should be like this, but... */
-	const_string(const const_string& s)
-		: cstring(strcpy(new char[s.size() + 1], s.c_str())) { }
-#else
-	/** Copy constructor.
-	 * When a vector grows, libstdc++ calls the copy constructor for
-	 * each element of the vector, which would invalidate any cstring
-	 * that point to this const_string. To work around this issue, the
-	 * new const_string gets the original data, and the old
-	 * const_string gets the copy, which will probably be destructed
-	 * soon. Making the copy is wasteful, but the C++ standard does
-	 * not help us out here.
-	 */
-	const_string(const const_string& s) : cstring(s.c_str())
-	{
-		const_cast<const_string&>(s).m_p
-			= strcpy(new char[s.size() + 1], s.c_str());
-	}
-#endif
+		: cstring(strcpy(const_cast<char*>(
+						constStringArenaAlloc(s.size() + 1)),
+					s.c_str())) { }
 
-	~const_string() { delete[] m_p; }
+	const_string(const const_string& s) : cstring(s.m_p) { }
 
 	const_string& operator=(const const_string& s)
 	{
-		assert(false);
-		if (this == &s)
-			return *this;
-		assert(m_p != s.m_p);
-		delete[] m_p;
-		m_p = strcpy(new char[s.size() + 1], s.c_str());
+		m_p = s.m_p;
 		return *this;
 	}
 
@@ -57,7 +57,10 @@ Sequence reverseComplement(const Sequence& s)
 	return rc;
 }
 
-static const uint8_t b2C[256] = {
+/** A table mapping a character to its base code, ignoring case.
+ * Characters that are not a nucleotide or colour-space base map to
+ * 0xFF. */
+const uint8_t baseToCodeTable[256] = {
 	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, //0
 	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
 	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, //1
@@ -95,7 +98,7 @@ static const uint8_t b2C[256] = {
 /** Return the base enumeration for the specified character. */
 uint8_t baseToCode(char base)
 {
-	uint8_t r = b2C[unsigned(base)];
+	uint8_t r = baseToCodeTable[uint8_t(base)];
 	if (r != 0xFF) return r;
 
 	cerr << "error: unexpected character: '" 
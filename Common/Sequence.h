@@ -17,6 +17,11 @@ char nucleotideToColourSpace(char a, char b);
 uint8_t baseToCode(char base);
 char codeToBase(uint8_t code);
 
+/** A table mapping a character to its base code, ignoring case.
+ * Characters that are not a nucleotide or colour-space base map to
+ * 0xFF. */
+extern const uint8_t baseToCodeTable[256];
+
 /** Return true if c is one of [ACGTacgt]. */
 static inline bool isACGT(char c)
 {
@@ -7,12 +7,26 @@
 #include "UnorderedMap.h"
 #include <cctype>
 #include <cmath>
+#include <cstdio>
 #include <cstdlib>
 #include <getopt.h>
+#if _OPENMP
+# include <omp.h>
+#endif
 #include <iostream>
+#include <limits>
 #include <numeric>
 #include <sstream>
 #include <string>
+#if (defined(__GNUC__) && defined(__x86_64__)) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/** Compile scalar, SSSE3 and AVX2 variants of the pile-up kernel
+ * into the one binary and pick the widest one at run time. */
+#if defined(__GNUC__) && defined(__x86_64__)
+# define COUNT_BASES_DISPATCH 1
+#endif
 
 using namespace std;
 
@@ -38,6 +52,7 @@ static const char USAGE_MESSAGE[] =
 "\n"
 " Options:\n"
 "\n"
+"  -j, --threads=N       use N parallel threads [1]\n"
 "  -o, --out=OUTPUT      write the output FASTA file to OUTPUT\n"
 "  -p, --pileup=PILEUP   write the pileup to PILEUP\n"
 "      --nt              output nucleotide contigs [default]\n"
@@ -50,6 +65,8 @@ static const char USAGE_MESSAGE[] =
 "Report bugs to <" PACKAGE_BUGREPORT ">.\n";
 
 namespace opt {
+	/** The number of parallel threads. */
+	static int threads = 1;
 	static string outPath;
 	static string pileupPath;
 	static bool csToNt;
@@ -57,12 +74,13 @@ namespace opt {
 	static int onlyVariants;
 }
 
-static const char shortopts[] = "o:p:vV";
+static const char shortopts[] = "j:o:p:vV";
 
 enum { OPT_HELP = 1, OPT_VERSION };
 
 static const struct option longopts[] = {
 	{ "verbose",     no_argument,       NULL, 'v' },
+	{ "threads",     required_argument, NULL, 'j' },
 	{ "out",		 required_argument, NULL, 'o' },
 	{ "pileup",      required_argument, NULL, 'p' },
 	{ "variants",    no_argument,		&opt::onlyVariants, 1 },
@@ -73,33 +91,67 @@ static const struct option longopts[] = {
 	{ NULL, 0, NULL, 0 }
 };
 
-struct BaseCount {
-	unsigned count[4];
-	BaseCount() { fill(count, count + 4, 0); }
+/** The number of each base seen at each position of a contig. The
+ * counts are stored as one contiguous column per base so that summing
+ * and selecting the consensus base read four sequential streams. A
+ * 16-bit counter is ample for typical coverage and halves the memory
+ * traffic of the pile-up; increments saturate at 65535 rather than
+ * wrap in pathologically deep pile-ups. */
+struct BaseCounts {
+	vector<uint16_t> count[4];
 
-	/** Return the number of reads at this position. */
-	unsigned sum() const { return accumulate(count, count+4, 0); }
+	/** Return the number of positions. */
+	size_t size() const { return count[0].size(); }
 
-	friend ostream& operator <<(ostream& out, const BaseCount& base)
+	/** Resize to n positions and zero the counts. */
+	void resize(size_t n)
 	{
-		out << base.count[0];
-		for (int x = 1; x < 4; x++)
-			out << '\t' << base.count[x];
-		return out;
+		for (int x = 0; x < 4; x++)
+			count[x].assign(n, 0);
+	}
+
+	/** Increment the count of base code at the specified position,
+	 * saturating at the maximum count. */
+	void increment(unsigned code, size_t pos)
+	{
+		uint16_t& c = count[code][pos];
+		c += c != numeric_limits<uint16_t>::max();
+	}
+
+	/** Return the number of reads at the specified position. */
+	unsigned sum(size_t pos) const
+	{
+		return count[0][pos] + count[1][pos]
+			+ count[2][pos] + count[3][pos];
 	}
-};
 
-typedef vector<BaseCount> BaseCounts;
+	/** Write the counts at the specified position, formatted into
+	 * a stack buffer so that one write replaces seven operations on
+	 * the stream. */
+	ostream& put(ostream& out, size_t pos) const
+	{
+		char buf[32];
+		int n = snprintf(buf, sizeof buf, "%d\t%d\t%d\t%d",
+				count[0][pos], count[1][pos],
+				count[2][pos], count[3][pos]);
+		assert(n > 0 && (size_t)n < sizeof buf);
+		return out.write(buf, n);
+	}
+};
 
 struct ContigCount {
 	Sequence seq;
+	/** 0x20 wherever seq is lower case and 0 elsewhere. ORing the
+	 * mask into the consensus restores the case of the contig. */
+	string caseMask;
 	unsigned coverage;
 	string comment;
 	BaseCounts counts;
 };
 
-/** A map of contigs. The alignments reference the contig by name. */
-typedef unordered_map<string, ContigCount> ContigMap;
+/** The contigs in input order, indexed by g_contigNames. The
+ * alignments reference the contig by name. */
+typedef vector<ContigCount> ContigMap;
 static ContigMap g_contigs;
 
 /** Read all contigs in and store the contigs in g_contigs and make a
@@ -111,7 +163,9 @@ static void readContigs(const string& contigsPath)
 	int count = 0;
 	for (FastaRecord rec; contigsFile >> rec;) {
 		const Sequence& seq = rec.seq;
-		ContigCount& contig = g_contigs[rec.id];
+		put(g_contigNames, count, rec.id);
+		g_contigs.push_back(ContigCount());
+		ContigCount& contig = g_contigs.back();
 		contig.seq = seq;
 
 		istringstream ss(rec.comment);
@@ -137,11 +191,17 @@ static void readContigs(const string& contigsPath)
 				assert(isalpha(seq[0]));
 		}
 
-		contig.counts = BaseCounts(contig.seq.length()
+		contig.counts.resize(contig.seq.length()
 				+ (opt::csToNt ? 1 : 0));
 
+		contig.caseMask.assign(contig.counts.size(), 0);
+		for (size_t i = 0; i < contig.seq.length(); i++)
+			if (islower(contig.seq[i]))
+				contig.caseMask[i] = 0x20;
+
 		count++;
 	}
+	g_contigNames.lock();
 	cerr << "Read " << count << " contigs\n";
 	assert(contigsFile.eof());
 	assert(count > 0);
@@ -149,13 +209,162 @@ static void readContigs(const string& contigsPath)
 
 typedef vector<Alignment> AlignmentVector;
 
+/** Tally the n bases of s into the counters starting at position
+ * pos. Characters that are not a base are skipped. */
+static void countBasesScalar(BaseCounts& counts, size_t pos,
+		const char* s, size_t n)
+{
+	assert(pos + n <= counts.size());
+	for (size_t x = 0; x < n; x++) {
+		uint8_t code = baseToCodeTable[(uint8_t)s[x]];
+		if (code < 4)
+			counts.increment(code, pos + x);
+	}
+}
+
+#if COUNT_BASES_DISPATCH
+/** Classify 16 bases of s and tally them into the 16 corresponding
+ * counters. The low nibbles of 'A', 'C', 'G' and 'T' (and of '0' to
+ * '3') are distinct, so a single PSHUFB keyed on the low nibble maps
+ * each byte to its base code. A second PSHUFB rebuilds the expected
+ * character from that nibble, and comparing it with the input rejects
+ * bytes, such as 'N', that merely share a nibble with a real base. */
+__attribute__((target("ssse3")))
+static inline void countBases16(BaseCounts& counts, size_t pos,
+		const char* s)
+{
+	// Map the low nibble of an upper-case base to its code.
+	const __m128i ntCode = _mm_setr_epi8(
+			0, 0, 0, 1, 3, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0);
+	// Map the low nibble of an upper-case base to that base.
+	const __m128i ntChar = _mm_setr_epi8(
+			0, 'A', 0, 'C', 'T', 0, 0, 'G',
+			0, 0, 0, 0, 0, 0, 0, 0);
+	// Likewise for the colour-space characters '0' to '3'.
+	const __m128i csCode = _mm_setr_epi8(
+			0, 1, 2, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+	const __m128i csChar = _mm_setr_epi8(
+			'0', '1', '2', '3', 0, 0, 0, 0,
+			0, 0, 0, 0, 0, 0, 0, 0);
+
+	__m128i v = _mm_loadu_si128(
+			reinterpret_cast<const __m128i*>(s));
+	// Fold lower case to upper case.
+	__m128i up = _mm_and_si128(v, _mm_set1_epi8((char)0xdf));
+	__m128i ntValid = _mm_cmpeq_epi8(up,
+			_mm_shuffle_epi8(ntChar, up));
+	__m128i csValid = _mm_cmpeq_epi8(v,
+			_mm_shuffle_epi8(csChar, v));
+	__m128i code = _mm_or_si128(
+			_mm_and_si128(ntValid, _mm_shuffle_epi8(ntCode, up)),
+			_mm_and_si128(csValid, _mm_shuffle_epi8(csCode, v)));
+
+	char codes[16];
+	_mm_storeu_si128(reinterpret_cast<__m128i*>(codes), code);
+	unsigned valid = _mm_movemask_epi8(
+			_mm_or_si128(ntValid, csValid));
+	for (; valid != 0; valid &= valid - 1) {
+		unsigned i = __builtin_ctz(valid);
+		counts.increment((uint8_t)codes[i], pos + i);
+	}
+}
+
+/** The SSSE3 variant of countBasesScalar. */
+__attribute__((target("ssse3")))
+static void countBasesSSSE3(BaseCounts& counts, size_t pos,
+		const char* s, size_t n)
+{
+	assert(pos + n <= counts.size());
+	size_t x = 0;
+	for (; x + 16 <= n; x += 16)
+		countBases16(counts, pos + x, s + x);
+	countBasesScalar(counts, pos + x, s + x, n - x);
+}
+
+/** Classify and tally 32 bases at once. VPSHUFB shuffles within
+ * each 128-bit lane, so broadcasting the 16-byte tables to both
+ * lanes makes this kernel lane-for-lane identical to countBases16. */
+__attribute__((target("avx2")))
+static inline void countBases32(BaseCounts& counts, size_t pos,
+		const char* s)
+{
+	const __m256i ntCode = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+			0, 0, 0, 1, 3, 0, 0, 2, 0, 0, 0, 0, 0, 0, 0, 0));
+	const __m256i ntChar = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+			0, 'A', 0, 'C', 'T', 0, 0, 'G',
+			0, 0, 0, 0, 0, 0, 0, 0));
+	const __m256i csCode = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+			0, 1, 2, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0));
+	const __m256i csChar = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+			'0', '1', '2', '3', 0, 0, 0, 0,
+			0, 0, 0, 0, 0, 0, 0, 0));
+
+	__m256i v = _mm256_loadu_si256(
+			reinterpret_cast<const __m256i*>(s));
+	// Fold lower case to upper case.
+	__m256i up = _mm256_and_si256(v, _mm256_set1_epi8((char)0xdf));
+	__m256i ntValid = _mm256_cmpeq_epi8(up,
+			_mm256_shuffle_epi8(ntChar, up));
+	__m256i csValid = _mm256_cmpeq_epi8(v,
+			_mm256_shuffle_epi8(csChar, v));
+	__m256i code = _mm256_or_si256(
+			_mm256_and_si256(ntValid,
+				_mm256_shuffle_epi8(ntCode, up)),
+			_mm256_and_si256(csValid,
+				_mm256_shuffle_epi8(csCode, v)));
+
+	char codes[32];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(codes), code);
+	unsigned valid = _mm256_movemask_epi8(
+			_mm256_or_si256(ntValid, csValid));
+	for (; valid != 0; valid &= valid - 1) {
+		unsigned i = __builtin_ctz(valid);
+		counts.increment((uint8_t)codes[i], pos + i);
+	}
+}
+
+/** The AVX2 variant of countBasesScalar. */
+__attribute__((target("avx2")))
+static void countBasesAVX2(BaseCounts& counts, size_t pos,
+		const char* s, size_t n)
+{
+	assert(pos + n <= counts.size());
+	size_t x = 0;
+	for (; x + 32 <= n; x += 32)
+		countBases32(counts, pos + x, s + x);
+	countBasesScalar(counts, pos + x, s + x, n - x);
+}
+
+/** Return the widest countBases variant this CPU supports. */
+static void (*resolveCountBases())(
+		BaseCounts&, size_t, const char*, size_t)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? countBasesAVX2
+		: __builtin_cpu_supports("ssse3") ? countBasesSSSE3
+		: countBasesScalar;
+}
+
+/** The pile-up kernel. The variant is chosen once, before main
+ * runs, so the same executable uses AVX2 on a machine that has it
+ * and falls back to SSSE3 or scalar code on one that does not. */
+static void (* const countBases)(
+		BaseCounts&, size_t, const char*, size_t)
+	= resolveCountBases();
+#else
+static void (* const countBases)(
+		BaseCounts&, size_t, const char*, size_t)
+	= countBasesScalar;
+#endif
+
+template <bool csToNt>
 static void readAlignment(string& line, string& readID,
 		Sequence& seq, AlignmentVector& alignments)
 {
 	char anchor;
 	istringstream s(line);
 
-	if (opt::colourSpace || opt::csToNt)
+	if (opt::colourSpace || csToNt)
 		s >> readID >> anchor >> seq;
 	else
 		s >> readID >> seq;
@@ -164,121 +373,206 @@ static void readAlignment(string& line, string& readID,
 	while (s >> alignment)
 		alignments.push_back(alignment);
 
-	if (!alignments.empty() && opt::csToNt
+	if (csToNt && !alignments.empty()
 			&& seq.find_first_not_of("0123") == string::npos)
 		seq = colourToNucleotideSpace(anchor, seq);
 }
 
-/** Builds the pile up of all reads based on the alignments and
- * read sequence */
-static void buildBaseQuality()
-{
-	if (opt::csToNt)
-		opt::colourSpace = false;
-
-	// for each read and/or set of alignments.
-	for (string line; getline(cin, line);) {
-		string readID;
-		Sequence seq;
-		AlignmentVector alignments;
-
-		readAlignment(line, readID, seq, alignments);
-
-		// If converting to NT space, check that at least one of the
-		// alignments starts at read location 0. Otherwise, it is
-		// likely to introduce a frameshift or erroneous sequence in
-		// the final consensus.
-		if (opt::csToNt) {
-			bool good = false;
-			for (AlignmentVector::const_iterator
-					alignIter = alignments.begin();
-					alignIter != alignments.end(); ++alignIter) {
-				if (alignIter->read_start_pos == 0) {
-					good = true;
-					break;
-				}
-			}
-			if (!good)
-				continue;
-		}
+/** A parsed read and its alignments, each resolved to the index of
+ * its contig. */
+struct ReadAlignments {
+	Sequence seq;
+	/** The reverse complement of seq, computed on first use. */
+	Sequence rcSeq;
+	vector<pair<unsigned, Alignment> > alignments;
+};
 
-		// For each alignment for the read.
+/** Parse one line of input into read. Reads that fail the
+ * colour-space sanity check get no alignments. The mode flag is a
+ * template parameter so that each instantiation carries no mode
+ * branches. */
+template <bool csToNt>
+static void parseReadAlignments(string& line, ReadAlignments& read)
+{
+	read.seq.clear();
+	read.rcSeq.clear();
+	read.alignments.clear();
+
+	string readID;
+	AlignmentVector alignments;
+	readAlignment<csToNt>(line, readID, read.seq, alignments);
+
+	// If converting to NT space, check that at least one of the
+	// alignments starts at read location 0. Otherwise, it is
+	// likely to introduce a frameshift or erroneous sequence in
+	// the final consensus.
+	if (csToNt) {
+		bool good = false;
 		for (AlignmentVector::const_iterator
 				alignIter = alignments.begin();
 				alignIter != alignments.end(); ++alignIter) {
-			string seqrc;
-			Alignment a;
-			if (alignIter->isRC) {
-				seqrc = reverseComplement(seq);
-				a = alignIter->flipQuery();
-			} else {
-				seqrc = seq;
-				a = *alignIter;
+			if (alignIter->read_start_pos == 0) {
+				good = true;
+				break;
 			}
-			const char* s = seqrc.c_str();
+		}
+		if (!good)
+			return;
+	}
 
-			ContigMap::iterator contigIt = g_contigs.find(a.contig);
-			if (contigIt == g_contigs.end()) {
-				cerr << "error: unexpected contig ID: `" << a.contig
-					<< "'\n";
-				exit(EXIT_FAILURE);
-			}
+	for (AlignmentVector::const_iterator
+			alignIter = alignments.begin();
+			alignIter != alignments.end(); ++alignIter) {
+		if (alignIter->isRC && read.rcSeq.empty())
+			read.rcSeq = reverseComplement(read.seq);
+		read.alignments.push_back(make_pair(
+					(unsigned)get(g_contigNames,
+						alignIter->contig),
+					*alignIter));
+	}
+}
 
-			BaseCounts& countsVec = contigIt->second.counts;
+/** Pile up those alignments of one read whose contig belongs to the
+ * specified shard. Sharding by contig lets every thread pile up the
+ * same batch of reads concurrently without locking: each count
+ * column has exactly one writer. */
+template <bool csToNt>
+static void pileupRead(const ReadAlignments& read,
+		unsigned shard, unsigned numShards)
+{
+	typedef vector<pair<unsigned, Alignment> >::const_iterator It;
+	for (It alignIter = read.alignments.begin();
+			alignIter != read.alignments.end(); ++alignIter) {
+		if (alignIter->first % numShards != shard)
+			continue;
+		Alignment a;
+		const char* s;
+		if (alignIter->second.isRC) {
+			s = read.rcSeq.c_str();
+			a = alignIter->second.flipQuery();
+		} else {
+			s = read.seq.c_str();
+			a = alignIter->second;
+		}
 
-			int read_min;
-			int read_max;
-			if (!opt::csToNt) {
-				read_min = a.read_start_pos - a.contig_start_pos;
-				read_min = read_min > 0 ? read_min : 0;
+		BaseCounts& countsVec
+			= g_contigs[alignIter->first].counts;
 
-				read_max = a.read_start_pos + countsVec.size() -
-					a.contig_start_pos;
-				read_max = read_max < a.read_length
-					? read_max : a.read_length;
-			} else {
-				read_min = a.read_start_pos;
-				read_max = read_min + a.align_length + 1;
-			}
+		int read_min;
+		int read_max;
+		if (!csToNt) {
+			read_min = a.read_start_pos - a.contig_start_pos;
+			read_min = read_min > 0 ? read_min : 0;
 
-			if ((int)countsVec.size() < a.contig_start_pos
-					- a.read_start_pos + read_max - 1)
-				cerr << countsVec.size() << '\n';
-
-			// Assertions to make sure alignment math was done right.
-			assert((int)countsVec.size() >= a.contig_start_pos
-					- a.read_start_pos + read_max - 1);
-			assert(read_max <= (int)seq.length());
-			assert(read_min >= 0);
-
-			// Pile-up every base in the read to the contig.
-			for (int x = read_min; x < read_max; x++) {
-				char c = toupper(s[x]);
-				switch (c) {
-				  case 'A': case 'C': case 'G': case 'T':
-				  case '0': case '1': case '2': case '3':
-					unsigned pos
-						= a.contig_start_pos - a.read_start_pos + x;
-					assert(pos < countsVec.size());
-					countsVec[pos].count[baseToCode(c)]++;
-				}
+			read_max = a.read_start_pos + countsVec.size() -
+				a.contig_start_pos;
+			read_max = read_max < a.read_length
+				? read_max : a.read_length;
+		} else {
+			read_min = a.read_start_pos;
+			read_max = read_min + a.align_length + 1;
+		}
+
+		if ((int)countsVec.size() < a.contig_start_pos
+				- a.read_start_pos + read_max - 1)
+			cerr << countsVec.size() << '\n';
+
+		// Assertions to make sure alignment math was done right.
+		assert((int)countsVec.size() >= a.contig_start_pos
+				- a.read_start_pos + read_max - 1);
+		assert(read_max <= (int)read.seq.length());
+		assert(read_min >= 0);
+
+		// Pile-up every base in the read to the contig.
+		if (read_max > read_min)
+			countBases(countsVec,
+					a.contig_start_pos - a.read_start_pos
+						+ read_min,
+					s + read_min, read_max - read_min);
+	}
+}
+
+/** The number of reads parsed and piled up per batch. */
+static const size_t BATCH_SIZE = 65536;
+
+/** Parse one batch of lines in parallel and pile up the resulting
+ * reads, with the contigs sharded across threads. */
+template <bool csToNt>
+static void processBatch(vector<string>& lines,
+		vector<ReadAlignments>& reads)
+{
+	reads.resize(lines.size());
+#pragma omp parallel
+	{
+#if _OPENMP
+		unsigned numShards = omp_get_num_threads();
+		unsigned shard = omp_get_thread_num();
+#else
+		unsigned numShards = 1;
+		unsigned shard = 0;
+#endif
+#pragma omp for
+		for (size_t i = 0; i < lines.size(); i++)
+			parseReadAlignments<csToNt>(lines[i], reads[i]);
+		// The loop above ends in a barrier: every read is
+		// parsed before the pile-up starts.
+		for (size_t i = 0; i < reads.size(); i++)
+			pileupRead<csToNt>(reads[i], shard, numShards);
+	}
+}
+
+/** Builds the pile up of all reads based on the alignments and
+ * read sequence. The reads are handled in batches: each batch is
+ * parsed in parallel and then piled up by all threads at once, with
+ * the contigs sharded across threads. */
+static void buildBaseQuality()
+{
+	if (opt::csToNt)
+		opt::colourSpace = false;
+
+	// Read standard input with buffered stdio, reusing one line
+	// buffer across reads, which is markedly cheaper than
+	// iostreams for this many short lines.
+	char* lineBuf = NULL;
+	size_t lineBufSize = 0;
+
+	vector<string> lines;
+	vector<ReadAlignments> reads;
+	bool more = true;
+	while (more) {
+		lines.clear();
+		while (lines.size() < BATCH_SIZE) {
+			ssize_t len = getline(&lineBuf, &lineBufSize, stdin);
+			if (len == -1) {
+				more = false;
+				break;
 			}
+			if (len > 0 && lineBuf[len - 1] == '\n')
+				len--;
+			lines.push_back(string(lineBuf, len));
 		}
+		if (lines.empty())
+			break;
+		if (opt::csToNt)
+			processBatch<true>(lines, reads);
+		else
+			processBatch<false>(lines, reads);
 	}
+	free(lineBuf);
 }
 
 /** Returns the most likely base found by the pile up count. */
-static char selectBase(const BaseCount& count, unsigned& sumBest,
-		unsigned& sumSecond)
+static char selectBase(const BaseCounts& counts, size_t pos,
+		unsigned& sumBest, unsigned& sumSecond)
 {
 	int bestBase = -1;
 	unsigned bestCount = 0;
 	unsigned secondCount = 0;
 	for (int x = 0; x < 4; x++) {
-		if (count.count[x] > bestCount) {
+		if (counts.count[x][pos] > bestCount) {
 			bestBase = x;
 			secondCount = bestCount;
-			bestCount = count.count[x];
+			bestCount = counts.count[x][pos];
 		}
 	}
 
@@ -290,77 +584,163 @@ static char selectBase(const BaseCount& count, unsigned& sumBest,
 	return codeToBase(bestBase);
 }
 
-/** Convert all 'N' bases to nt's based on local information. */
-static void fixUnknown(Sequence& ntSeq, const Sequence& csSeq )
+/** Call the consensus base at every position of a contig, filling in
+ * outSeq and accumulating the best and runner-up counts. The case of
+ * the contig is restored on the fly by ORing in caseMask. The AVX2
+ * path handles sixteen positions per iteration, reading the four
+ * 16-bit count columns as streams. It reproduces selectBase exactly:
+ * the first of the tied largest counts wins, and the runner-up is the
+ * largest count seen before the winner. */
+static void selectBases(const BaseCounts& counts,
+		const string& caseMask, Sequence& outSeq,
+		unsigned& sumBest, unsigned& sumSecond)
 {
-	size_t index = ntSeq.find_first_of('N');
-	size_t rindex = ntSeq.find_last_of('N');
-	char base;
-#if 0
-	if (index == 0) {
-#if 0
-		for (index = ntSeq.find_first_of("ACGT"); index > 0; index--)
-#endif
-		index = ntSeq.find_first_of("ACGT");
-		while (index != 0) {
-			base = colourToNucleotideSpace(ntSeq.at(index),
-					csSeq.at(index - 1));
-			ntSeq.replace(index - 1, 1, 1, base);
-			//ntSeq[index-1] = base;
-			index = ntSeq.find_first_of("ACGT");
-		}
-		index = ntSeq.find_first_of('N');
+	size_t n = counts.size();
+	size_t x = 0;
+#ifdef __AVX2__
+	const char* bases = opt::colourSpace ? "0123" : "ACGT";
+	const __m256i zero = _mm256_setzero_si256();
+	__m256i sumBestV = _mm256_setzero_si256();
+	__m256i sumSecondV = _mm256_setzero_si256();
+	for (; x + 16 <= n; x += 16) {
+		__m256i a = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(
+					&counts.count[0][x]));
+		__m256i c = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(
+					&counts.count[1][x]));
+		__m256i g = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(
+					&counts.count[2][x]));
+		__m256i t = _mm256_loadu_si256(
+				reinterpret_cast<const __m256i*>(
+					&counts.count[3][x]));
+		__m256i ac = _mm256_max_epu16(a, c);
+		__m256i acg = _mm256_max_epu16(ac, g);
+		__m256i best = _mm256_max_epu16(acg, t);
+
+		// Identify the first base matching the largest count.
+		__m256i mA = _mm256_cmpeq_epi16(a, best);
+		__m256i mC = _mm256_andnot_si256(mA,
+				_mm256_cmpeq_epi16(c, best));
+		__m256i mAC = _mm256_or_si256(mA, mC);
+		__m256i mG = _mm256_andnot_si256(mAC,
+				_mm256_cmpeq_epi16(g, best));
+		__m256i mACG = _mm256_or_si256(mAC, mG);
+		__m256i mT = _mm256_andnot_si256(mACG,
+				_mm256_set1_epi16(-1));
+
+		// The runner-up is the largest count before the winner.
+		__m256i second = _mm256_or_si256(_mm256_or_si256(
+					_mm256_and_si256(mC, a),
+					_mm256_and_si256(mG, ac)),
+				_mm256_and_si256(mT, acg));
+
+		// Widen to 32 bits and accumulate.
+		sumBestV = _mm256_add_epi32(sumBestV, _mm256_add_epi32(
+					_mm256_unpacklo_epi16(best, zero),
+					_mm256_unpackhi_epi16(best, zero)));
+		sumSecondV = _mm256_add_epi32(sumSecondV, _mm256_add_epi32(
+					_mm256_unpacklo_epi16(second, zero),
+					_mm256_unpackhi_epi16(second, zero)));
+
+		__m256i idx = _mm256_or_si256(_mm256_or_si256(
+					_mm256_and_si256(mC, _mm256_set1_epi16(1)),
+					_mm256_and_si256(mG, _mm256_set1_epi16(2))),
+				_mm256_and_si256(mT, _mm256_set1_epi16(3)));
+
+		uint16_t idxs[16], bests[16];
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(idxs), idx);
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(bests), best);
+		for (int j = 0; j < 16; j++)
+			outSeq[x + j] = (bests[j] == 0 ? 'N' : bases[idxs[j]])
+				| caseMask[x + j];
 	}
+
+	unsigned sums[8];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(sums), sumBestV);
+	for (int j = 0; j < 8; j++)
+		sumBest += sums[j];
+	_mm256_storeu_si256(reinterpret_cast<__m256i*>(sums),
+			sumSecondV);
+	for (int j = 0; j < 8; j++)
+		sumSecond += sums[j];
 #endif
+	for (; x < n; x++)
+		outSeq[x] = selectBase(counts, x, sumBest, sumSecond)
+			| caseMask[x];
+}
 
-	if (index == 0 || rindex == ntSeq.length() - 1) {
+/** Convert all 'N' bases to nt's based on local information. */
+static void fixUnknown(Sequence& ntSeq, const Sequence& csSeq )
+{
+	// Trim Ns off the ends of the sequence.
+	if (ntSeq[0] == 'N' || ntSeq[ntSeq.length() - 1] == 'N')
 		ntSeq = ntSeq.substr(ntSeq.find_first_of("ACGT"),
 				ntSeq.find_last_of("ACGT") -
 				ntSeq.find_first_of("ACGT") + 1);
-		index = ntSeq.find_first_of('N');
-	}
 
-	while (index != string::npos) {
-		// If the base isn't the first or last base in the seq...
-		base = colourToNucleotideSpace(ntSeq.at(index - 1),
-				csSeq.at(index - 1));
-		ntSeq.replace(index, 1, 1, base);
-		index = ntSeq.find_first_of('N');
-	}
+	// A single left-to-right pass: each remaining N is recoded from
+	// the base just written to its left, which a previous iteration
+	// has already fixed, so no rescanning from the start is needed.
+	for (size_t i = 1; i < ntSeq.length(); i++)
+		if (ntSeq[i] == 'N')
+			ntSeq[i] = colourToNucleotideSpace(
+					ntSeq.at(i - 1), csSeq.at(i - 1));
 }
 
-static void writePileup(ostream& out,
+/** The pileup output buffer is flushed once it reaches this size. */
+static const size_t PILEUP_BUFFER_SIZE = 64 * 1024;
+
+/** Write the buffered pileup to out and empty the buffer. */
+static void flushPileup(ostream& out, string& buf)
+{
+	out.write(buf.data(), buf.size());
+	assert(out.good());
+	buf.clear();
+}
+
+/** Append one pileup record to buf, flushing buf to out when it
+ * grows past PILEUP_BUFFER_SIZE. Building the record in a reusable
+ * buffer avoids a formatted-output call per field and a temporary
+ * string per base column. */
+static void writePileup(ostream& out, string& buf,
 		const string &id, unsigned pos,
 		char refc, char genotype,
-		const BaseCount& counts)
+		const BaseCounts& counts)
 {
 	char foldrefc = toupper(refc);
 	if (opt::onlyVariants && foldrefc == genotype)
 		return;
-	out << id << '\t' // reference sequence name
-		<< 1 + pos << '\t' // reference coordinate
-		<< refc << '\t' // reference base
-		<< genotype << '\t' // genotype
-		<< "25\t" // P(genotype is wrong)
-		<< "25\t" // P(genotype is the same as the reference)
-		<< "25\t" // RMS mapping quality
-		<< counts.sum() << '\t'; // number of reads
+	buf += id; // reference sequence name
+	buf += '\t';
+	buf += to_string(1 + pos); // reference coordinate
+	buf += '\t';
+	buf += refc; // reference base
+	buf += '\t';
+	buf += genotype; // genotype
+	buf += "\t25" // P(genotype is wrong)
+		"\t25" // P(genotype is the same as the reference)
+		"\t25\t"; // RMS mapping quality
+	buf += to_string(counts.sum(pos)); // number of reads
+	buf += '\t';
 	switch (foldrefc) {
 	  case 'A': case 'C': case 'G': case 'T':
 	  case '0': case '1': case '2': case '3': {
 		uint8_t ref = baseToCode(foldrefc);
 		for (int i = 0; i < 4; i++)
 			if (i != ref)
-				out << string(counts.count[i], codeToBase(i));
-		out << string(counts.count[ref], '.');
+				buf.append(counts.count[i][pos], codeToBase(i));
+		buf.append(counts.count[ref][pos], '.');
 		break;
 	  }
 	  default:
 		for (int i = 0; i < 4; i++)
-				out << string(counts.count[i], codeToBase(i));
+				buf.append(counts.count[i][pos], codeToBase(i));
 	}
-	out << '\n';
-	assert(out.good());
+	buf += '\n';
+	if (buf.size() >= PILEUP_BUFFER_SIZE)
+		flushPileup(out, buf);
 }
 
 /** Forms contigs based on the consensus of each base and outputs them
@@ -376,20 +756,31 @@ static void consensus(const string& outPath, const string& pileupPath)
 		: (pileupFile.open(pileupPath.c_str()), pileupFile);
 	assert_good(pileupOut, pileupPath);
 
+	string pileupBuf;
+	// The consensus sequence, reused across contigs.
+	Sequence outSeq;
 	unsigned numIgnored = 0;
 	for (ContigMap::const_iterator it = g_contigs.begin();
 			it != g_contigs.end(); ++it) {
-		const ContigCount& contig = it->second;
-		unsigned seqLength = it->second.counts.size();
+		const ContigCount& contig = *it;
+		string id = get(g_contigNames,
+				it - g_contigs.begin()).c_str();
+		unsigned seqLength = contig.counts.size();
+
+		// The count columns of the next contig are cold: they were
+		// last touched while piling up its reads. Prefetch them now
+		// so selecting its bases does not start with a miss.
+		if (it + 1 != g_contigs.end()) {
+			const BaseCounts& next = (it + 1)->counts;
+			for (int x = 0; x < 4; x++)
+				__builtin_prefetch(&next.count[x][0], 0, 1);
+		}
 
-		Sequence outSeq(seqLength, 'N');
+		outSeq.assign(seqLength, 'N');
 		unsigned sumBest = 0;
 		unsigned sumSecond = 0;
-		for (unsigned x = 0; x < seqLength; x++) {
-			char c = selectBase(
-					it->second.counts[x], sumBest, sumSecond);
-			outSeq[x] = islower(contig.seq[x]) ? tolower(c) : c;
-		}
+		selectBases(contig.counts, contig.caseMask, outSeq,
+				sumBest, sumSecond);
 
 		if (outSeq.find_first_of("ACGT") != string::npos) {
 			// Check that the average percent agreement was enough to
@@ -400,7 +791,7 @@ static void consensus(const string& outPath, const string& pileupPath)
 				numIgnored++;
 				if (opt::csToNt) {
 					if (opt::verbose > 0)
-						cerr << "warning: Contig " << it->first
+						cerr << "warning: Contig " << id
 							<< " has less than 90% agreement "
 							"and will not be converted.\n";
 				} else
@@ -413,49 +804,42 @@ static void consensus(const string& outPath, const string& pileupPath)
 				if (!contig.comment.empty())
 					comment << ' ' << contig.comment;
 				outFile << FastaRecord(
-						it->first, comment.str(), outSeq);
+						id, comment.str(), outSeq);
 				assert(outFile.good());
 			}
 
-			if (opt::verbose > 1) {
-				// ID pos reference genotype A C G T
-				if (opt::csToNt)
-					for (unsigned i = 0; i < seqLength - 1; i++)
-						cout << it->first << '\t' << 1+i
-							<< '\t' << contig.seq[i]
-							<< '\t' << nucleotideToColourSpace(
-									outSeq[i], outSeq[i + 1])
-							<< '\t' << contig.counts[i].sum()
-							<< '\t' << contig.counts[i] << '\n';
-				else
-					for (unsigned i = 0; i < seqLength; i++)
-						cout << it->first << '\t' << 1+i
+			// Stream the verbose dump and the pileup in a single
+			// pass, computing the genotype once per position.
+			if (opt::verbose > 1 || !pileupPath.empty()) {
+				unsigned end = opt::csToNt
+					? seqLength - 1 : seqLength;
+				for (unsigned i = 0; i < end; i++) {
+					char genotype = opt::csToNt
+						? nucleotideToColourSpace(
+								outSeq[i], outSeq[i + 1])
+						: outSeq[i];
+					if (opt::verbose > 1)
+						// ID pos reference genotype A C G T
+						contig.counts.put(cout
+							<< id << '\t' << 1+i
 							<< '\t' << contig.seq[i]
-							<< '\t' << outSeq[i]
-							<< '\t' << contig.counts[i].sum()
-							<< '\t' << contig.counts[i] << '\n';
-			}
-
-			if (!pileupPath.empty()) {
-				if (opt::csToNt)
-					for (unsigned i = 0; i < seqLength-1; i++)
-						writePileup(pileupOut, it->first, i,
-								contig.seq[i],
-								nucleotideToColourSpace(
-									outSeq[i], outSeq[i+1]),
-								contig.counts[i]);
-				else
-					for (unsigned i = 0; i < seqLength; i++)
-						writePileup(pileupOut, it->first, i,
-								contig.seq[i], outSeq[i],
-								contig.counts[i]);
+							<< '\t' << genotype
+							<< '\t' << contig.counts.sum(i)
+							<< '\t', i) << '\n';
+					if (!pileupPath.empty())
+						writePileup(pileupOut, pileupBuf, id, i,
+								contig.seq[i], genotype,
+								contig.counts);
+				}
 			}
 		} else if (opt::verbose > 0) {
-			cerr << "warning: Contig " << it->first
+			cerr << "warning: Contig " << id
 				<< " was not supported by a complete read "
 				"and was omitted.\n";
 		}
 	}
+	if (!pileupBuf.empty())
+		flushPileup(pileupOut, pileupBuf);
 }
 
 int main(int argc, char** argv)
@@ -467,6 +851,7 @@ int main(int argc, char** argv)
 		switch (c) {
 			case '?': die = true; break;
 			case 'v': opt::verbose++; break;
+			case 'j': arg >> opt::threads; break;
 			case 'o': arg >> opt::outPath; break;
 			case 'p': arg >> opt::pileupPath; break;
 			case 'V': opt::onlyVariants = true; break;
@@ -502,6 +887,11 @@ int main(int argc, char** argv)
 		exit(EXIT_FAILURE);
 	}
 
+#if _OPENMP
+	if (opt::threads > 0)
+		omp_set_num_threads(opt::threads);
+#endif
+
 	readContigs(argv[optind++]);
 	buildBaseQuality();
 	consensus(opt::outPath, opt::pileupPath);